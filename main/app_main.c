@@ -14,6 +14,15 @@
 #define TOPIC_PREFIX "devices/"
 #define TEMP_DEVICE_ID "1234567890ab"
 
+// Config digest exchange, see publish_config_digest()
+#define DEVICE_TOPIC TOPIC_PREFIX TEMP_DEVICE_ID "/"
+#define DIGEST_TOPIC TOPIC_PREFIX TEMP_DEVICE_ID "/digest"
+#define SYNC_TOPIC TOPIC_PREFIX TEMP_DEVICE_ID "/sync/#"
+#define SYNC_PREFIX TOPIC_PREFIX TEMP_DEVICE_ID "/sync/"
+#define SETTINGS_TOPIC TOPIC_PREFIX TEMP_DEVICE_ID "/settings/#"
+#define SYNC_TIMEOUT_MS 10000
+#define SYNC_QUEUE_LENGTH 8
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -30,6 +39,7 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/queue.h"
+#include "freertos/timers.h"
 
 #include "lwip/sockets.h"
 #include "lwip/dns.h"
@@ -148,6 +158,124 @@ void task_write_outputs(void *pvParameters)
 
 esp_err_t mqtt_message_receive(void *event_data);
 
+typedef enum
+{
+    SYNC_EVENT_CONNECTED,
+    SYNC_EVENT_DISCONNECTED,
+    SYNC_EVENT_DONE,
+    SYNC_EVENT_TIMEOUT
+} sync_event_type_t;
+
+typedef struct
+{
+    sync_event_type_t type;
+    uint32_t session; // generation of the MQTT connection the event belongs to
+} sync_event_t;
+
+// Events for task_config_sync, which owns all of the digest exchange state
+static QueueHandle_t sync_queue = NULL;
+static TimerHandle_t sync_timer = NULL;
+static bool config_sync_enabled = false;
+// Bumped on every MQTT_EVENT_CONNECTED, only touched from the MQTT task
+static uint32_t mqtt_session = 0;
+// Set by task_config_sync only while the current session finished with sync/done,
+// read by mqtt_message_receive to drop the retained settings replay
+static volatile bool settings_synced_by_done = false;
+
+/*
+ * Publish a compact digest of the current config, a version counter and a hash
+ * over the config table.  The server compares the hash against the device's
+ * profile and only publishes the keys that differ on
+ * devices/<id>/sync/<key>/set, followed by devices/<id>/sync/done.
+ * Retained so the server can list devices that have drifted from their profile.
+ */
+static void publish_config_digest(void)
+{
+    char data[64];
+    sprintf(data, "{\"version\":%u, \"hash\":\"%08x\"}", get_config_version(), get_config_hash());
+    esp_mqtt_client_publish(mqtt_client, DIGEST_TOPIC, data, 0, 1, 1);
+}
+
+static void post_sync_event(sync_event_type_t type, uint32_t session)
+{
+    sync_event_t event = {.type = type, .session = session};
+    if (xQueueSend(sync_queue, &event, 0) != pdTRUE)
+        ESP_LOGE(TAG, "Config sync queue full, dropped event %d", type);
+}
+
+// Runs in the timer service task, which must not block, so only signal task_config_sync.
+// The timer ID holds the session the timer was started for.
+static void sync_timeout_callback(TimerHandle_t timer)
+{
+    post_sync_event(SYNC_EVENT_TIMEOUT, (uint32_t)(uintptr_t)pvTimerGetTimerID(timer));
+}
+
+/*
+ * Settings subscriptions are deferred until the digest exchange finishes,
+ * so a reconnect only costs the keys that actually changed.  If the server
+ * never answers the digest, fall back to subscribing after SYNC_TIMEOUT_MS.
+ * Events are handled in order on this task, and DONE/TIMEOUT events from an
+ * earlier session are ignored, so a timeout racing sync/done or a reconnect
+ * can't subscribe twice or mark a new session as synced.
+ */
+void task_config_sync(void *pvParameters)
+{
+    bool connected = false;
+    bool synced = false;
+    uint32_t session = 0;
+    sync_event_t event;
+    while (1)
+    {
+        if (xQueueReceive(sync_queue, &event, portMAX_DELAY) != pdTRUE)
+            continue;
+        switch (event.type)
+        {
+        case SYNC_EVENT_CONNECTED:
+            connected = true;
+            synced = false;
+            session = event.session;
+            settings_synced_by_done = false;
+            esp_mqtt_client_subscribe(mqtt_client, SYNC_TOPIC, 0);
+            publish_config_digest();
+            vTimerSetTimerID(sync_timer, (void *)(uintptr_t)session);
+            xTimerReset(sync_timer, portMAX_DELAY);
+            break;
+        case SYNC_EVENT_DISCONNECTED:
+            connected = false;
+            settings_synced_by_done = false;
+            xTimerStop(sync_timer, portMAX_DELAY);
+            break;
+        case SYNC_EVENT_DONE:
+        case SYNC_EVENT_TIMEOUT:
+            if (!connected || synced || event.session != session)
+                break;
+            // Without a digest reply the retained settings replay is the only
+            // source of config, so accept it.  set_config skips unchanged values.
+            if (event.type == SYNC_EVENT_TIMEOUT)
+                ESP_LOGW(TAG, "No reply to config digest, subscribing to all settings");
+            settings_synced_by_done = (event.type == SYNC_EVENT_DONE);
+            synced = true;
+            xTimerStop(sync_timer, portMAX_DELAY);
+            esp_mqtt_client_subscribe(mqtt_client, SETTINGS_TOPIC, 0);
+            publish_config_digest();
+            break;
+        }
+    }
+}
+
+static esp_err_t config_sync_init(void)
+{
+    sync_queue = xQueueCreate(SYNC_QUEUE_LENGTH, sizeof(sync_event_t));
+    if (sync_queue == NULL)
+        return ESP_FAIL;
+    sync_timer = xTimerCreate("config_sync", pdMS_TO_TICKS(SYNC_TIMEOUT_MS), pdFALSE, NULL, sync_timeout_callback);
+    if (sync_timer == NULL)
+        return ESP_FAIL;
+    if (xTaskCreatePinnedToCore(&task_config_sync, "config_sync", 1024 * 4, NULL, 5, NULL, APP_CPU_NUM) != pdPASS)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
 static void log_error_if_nonzero(const char *message, int error_code)
 {
     if (error_code != 0)
@@ -221,7 +349,11 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        esp_mqtt_client_subscribe(mqtt_client, "devices/1234567890ab/#", 0);
+        mqtt_session++;
+        if (config_sync_enabled)
+            post_sync_event(SYNC_EVENT_CONNECTED, mqtt_session);
+        else
+            esp_mqtt_client_subscribe(mqtt_client, SETTINGS_TOPIC, 0);
         esp_mqtt_client_subscribe(mqtt_client, "devices/000000000001/temperature", 0);
         esp_mqtt_client_subscribe(mqtt_client, "devices/000000000001/humidity", 0);
         esp_mqtt_client_subscribe(mqtt_client, "devices/000000000001/co2", 0);
@@ -230,6 +362,8 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
         MQTT_OK = ESP_FAIL;
+        if (config_sync_enabled)
+            post_sync_event(SYNC_EVENT_DISCONNECTED, mqtt_session);
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
@@ -268,10 +402,21 @@ esp_err_t mqtt_message_receive(void *event_data)
     esp_mqtt_event_handle_t event = event_data;
     char topic[event->topic_len + 1];
     sprintf(topic, "%.*s", event->topic_len, event->topic);
+    // The broker only sets the retain flag when replaying on a new subscription.
+    // Sync deltas are always live.  Once sync/done has arrived a replayed setting
+    // could overwrite a value the digest exchange just set, so only live changes
+    // are accepted on this device's topics for the rest of the session.
+    if (event->retain
+        && (!strncmp(topic, SYNC_PREFIX, strlen(SYNC_PREFIX))
+            || (settings_synced_by_done && !strncmp(topic, DEVICE_TOPIC, strlen(DEVICE_TOPIC)))))
+    {
+        ESP_LOGW(TAG, "Ignoring retained message on %s", topic);
+        return ESP_OK;
+    }
     //"devices/xxxxxxxxxxxxxx/settings/ac_g_mode/set"
     char *rest = NULL;
     char *token;
-    char last[MAX_KEY_LENGTH];
+    char last[MAX_KEY_LENGTH] = "";
     int val = 0;
     // use strtok_r instead of strtok for thread safety
     for (token = strtok_r(topic, "/", &rest);
@@ -287,6 +432,9 @@ esp_err_t mqtt_message_receive(void *event_data)
             val = strtol(data, NULL, 10);
             set_config(last, val);
         }
+        // end of the delta list that answered our digest
+        if (!strcmp(token, "done") && !strcmp(last, "sync") && config_sync_enabled)
+            post_sync_event(SYNC_EVENT_DONE, mqtt_session);
         strcpy(last, token);
         if (!strcmp(last, "temperature"))
         {
@@ -311,6 +459,9 @@ static void mqtt_app_start(void)
         .uri = CONFIG_BROKER_URL,
     };
 
+    config_sync_enabled = (config_sync_init() == ESP_OK);
+    if (!config_sync_enabled)
+        ESP_LOGE(TAG, "Config sync unavailable, subscribing to all settings on connect");
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
@@ -404,8 +555,9 @@ void app_main(void)
     ESP_ERROR_CHECK(esp_eth_start(eth_handle));
 
     // ESP_ERROR_CHECK(i2cdev_init());
-    mqtt_app_start();
+    // config must be loaded before the first digest goes out on connect
     init_config();
+    mqtt_app_start();
     ESP_ERROR_CHECK(i2cdev_init());
 
     xSemaphoreOutputStatesReady = xSemaphoreCreateBinary();
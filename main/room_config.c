@@ -69,37 +69,54 @@ void update_hyst_state(hyst_config_t *h)
         h->state = (pv <= on_at || (h->state && pv <= off_at));
 }
 
-int32_t DUMMY;
+// Settings not wired to an output yet.  Each key needs its own storage so it
+// is persisted and hashed independently of the others.
+static int32_t ef_mode;
+static int32_t cf_mode;
+static int32_t d_temp_sp;
+static int32_t n_temp_sp;
+static int32_t light_out_pct;
+static int32_t hitemp_dim;
+static int32_t hitemp_cutout;
+static int32_t hitemp_reset;
+static int32_t co2_setback_s;
+static int32_t l_on_time_ts;
+static int32_t l_off_time_ts;
+static int32_t sr_len_s;
+static int32_t ss_len_s;
+
+// Incremented every time set_config actually changes a value, persisted in NVS
+static uint32_t config_version;
 
 config_item_t config[NUM_CONFIG_ITEMS] = {
     {"ac_g_mode", &(outputs[AC1_G].mode)},
     {"ac_y_mode", &(outputs[AC1_Y].mode)},
     {"ac_w_mode", &(outputs[AC1_W].mode)},
     {"dh_mode", &(outputs[DH].mode)},
-    {"ef_mode", &DUMMY},
+    {"ef_mode", &ef_mode},
     {"co2_mode", &(outputs[CO2].mode)},
-    {"cf_mode", &DUMMY},
-    {"d_temp_sp", &DUMMY}, // this needs to get mapped to both the cooling and heating 
-    {"n_temp_sp", &DUMMY}, // This is a special case, need to schedule a change 
+    {"cf_mode", &cf_mode},
+    {"d_temp_sp", &d_temp_sp}, // this needs to get mapped to both the cooling and heating 
+    {"n_temp_sp", &n_temp_sp}, // This is a special case, need to schedule a change 
     {"rh_sp", &(outputs[DH].hyst.setpoint)},
     {"co2_sp", &(outputs[CO2].hyst.setpoint)},
     {"co2_db", &(outputs[CO2].hyst.deadband)},
     {"co2_os", &(outputs[CO2].hyst.offset)},
-    {"light_out_pct", &DUMMY},
-    {"hitemp_dim", &DUMMY},
-    {"hitemp_cutout", &DUMMY},
-    {"hitemp_reset", &DUMMY},
+    {"light_out_pct", &light_out_pct},
+    {"hitemp_dim", &hitemp_dim},
+    {"hitemp_cutout", &hitemp_cutout},
+    {"hitemp_reset", &hitemp_reset},
     {"cool_db", &(outputs[AC1_Y].hyst.deadband)},
     {"cool_os", &(outputs[AC1_Y].hyst.offset)},
     {"heat_db", &(outputs[AC1_W].hyst.deadband)},
     {"heat_os", &(outputs[AC1_W].hyst.offset)},
     {"dh_db", &(outputs[DH].hyst.deadband)},
     {"dh_os", &(outputs[DH].hyst.offset)},
-    {"co2_setback_s", &DUMMY},
-    {"l_on_time_ts", &DUMMY},
-    {"l_off_time_ts", &DUMMY},
-    {"sr_len_s", &DUMMY},
-    {"ss_len_s", &DUMMY},
+    {"co2_setback_s", &co2_setback_s},
+    {"l_on_time_ts", &l_on_time_ts},
+    {"l_off_time_ts", &l_off_time_ts},
+    {"sr_len_s", &sr_len_s},
+    {"ss_len_s", &ss_len_s},
 };
 
 void init_config(void)
@@ -123,6 +140,12 @@ void init_config(void)
     }
     else
     {
+        err = nvs_get_u32(handle, CONFIG_VERSION_KEY, &config_version);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            config_version = 0;
+            nvs_set_u32(handle, CONFIG_VERSION_KEY, config_version);
+        }
         int32_t value = 0;
         for (int i = 0; i < NUM_CONFIG_ITEMS; i++)
         {
@@ -165,20 +188,58 @@ esp_err_t set_config(char *key, int32_t value)
     {
         if (!strcmp(key, config[i].key))
         {
-            *(config[i].value) = value;
+            // Nothing changed, skip the flash write and leave the version alone
+            if (*(config[i].value) == value)
+                continue;
 
             nvs_handle_t handle;
             esp_err_t err;
 
             // Open
             err = nvs_open("config", NVS_READWRITE, &handle);
-            printf("%s:%d\n", config[i].key, *(config[i].value));
             if (err != ESP_OK)
                 return err;
-            nvs_set_i32(handle, key, value);
-            nvs_commit(handle);
+            // Only apply the change once it is persisted, so the version in RAM
+            // and NVS agree and the digest is still right after a reboot
+            err = nvs_set_i32(handle, key, value);
+            if (err == ESP_OK)
+                err = nvs_set_u32(handle, CONFIG_VERSION_KEY, config_version + 1);
+            if (err == ESP_OK)
+                err = nvs_commit(handle);
             nvs_close(handle);
+            if (err != ESP_OK)
+                return err;
+            *(config[i].value) = value;
+            config_version++;
+            printf("%s:%d\n", config[i].key, *(config[i].value));
         }
     }
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+uint32_t get_config_version(void)
+{
+    return config_version;
+}
+
+// 32 bit FNV-1a over every key and its value, so the server can compare
+// against the hash of the device's profile without fetching every key
+uint32_t get_config_hash(void)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < NUM_CONFIG_ITEMS; i++)
+    {
+        for (const char *c = config[i].key; *c; c++)
+        {
+            hash ^= (uint8_t)*c;
+            hash *= 16777619u;
+        }
+        uint32_t value = (uint32_t)*(config[i].value);
+        for (int b = 0; b < 4; b++)
+        {
+            hash ^= (value >> (8 * b)) & 0xff;
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
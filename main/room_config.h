@@ -4,6 +4,7 @@
 #define NUM_BUCKETS 4
 #define NUM_CONFIG_ITEMS 28
 #define MAX_KEY_LENGTH 16
+#define CONFIG_VERSION_KEY "cfg_version"
 
 #define  NUM_OUTPUTS 8
 
@@ -27,6 +28,8 @@ extern int32_t co2;
 void init_config(void);
 void print_config(void);
 esp_err_t set_config(char *key, int32_t value);
+uint32_t get_config_version(void);
+uint32_t get_config_hash(void);
 
 typedef struct
 {